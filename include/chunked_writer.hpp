@@ -0,0 +1,604 @@
+#ifndef CMB_CHUNKED_WRITER_HPP_
+#define CMB_CHUNKED_WRITER_HPP_
+
+// (MIT license)
+/*
+Copyright(c) 2017 Christopher M. Bruns
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <QDir>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+#include <boost/array.hpp>
+#include <boost/multi_array.hpp>
+
+#ifdef CMB_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CMB_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "parallel_downsample.hpp"
+#include "performance_parameters.hpp"
+
+namespace cmb {
+
+	/// COMPRESSION: one codec per chunk file ///
+
+	// Which of these are available depends on the libraries found by CMake
+	enum chunk_compression_t {
+		CHUNK_COMPRESSION_NONE,
+		CHUNK_COMPRESSION_ZLIB,
+		CHUNK_COMPRESSION_ZSTD
+	};
+
+	// Best codec compiled in; raw chunks when there is none
+	inline chunk_compression_t default_chunk_compression()
+	{
+#if defined(CMB_HAVE_ZSTD)
+		return CHUNK_COMPRESSION_ZSTD;
+#elif defined(CMB_HAVE_ZLIB)
+		return CHUNK_COMPRESSION_ZLIB;
+#else
+		return CHUNK_COMPRESSION_NONE;
+#endif
+	}
+
+	// Codec description, as it appears in a Zarr ".zarray" file
+	inline std::string zarr_compressor_json(chunk_compression_t compression)
+	{
+		std::ostringstream json;
+		switch (compression) {
+		case CHUNK_COMPRESSION_ZLIB:
+			json << "{\"id\": \"zlib\", \"level\": " << CHUNK_COMPRESSION_LEVEL << "}";
+			break;
+		case CHUNK_COMPRESSION_ZSTD:
+			json << "{\"id\": \"zstd\", \"level\": " << CHUNK_COMPRESSION_LEVEL << "}";
+			break;
+		default:
+			json << "null";
+		}
+		return json.str();
+	}
+
+	inline std::vector<char> compress_chunk(const std::vector<char>& raw, chunk_compression_t compression)
+	{
+		switch (compression) {
+		case CHUNK_COMPRESSION_NONE:
+			return raw;
+#ifdef CMB_HAVE_ZLIB
+		case CHUNK_COMPRESSION_ZLIB: {
+			uLongf size = compressBound(static_cast<uLong>(raw.size()));
+			std::vector<char> result(size);
+			if (compress2(reinterpret_cast<Bytef*>(result.data()), &size,
+					reinterpret_cast<const Bytef*>(raw.data()), static_cast<uLong>(raw.size()),
+					CHUNK_COMPRESSION_LEVEL) != Z_OK)
+				throw std::runtime_error("zlib chunk compression failed");
+			result.resize(size);
+			return result;
+		}
+#endif
+#ifdef CMB_HAVE_ZSTD
+		case CHUNK_COMPRESSION_ZSTD: {
+			std::vector<char> result(ZSTD_compressBound(raw.size()));
+			std::size_t size = ZSTD_compress(result.data(), result.size(),
+				raw.data(), raw.size(), CHUNK_COMPRESSION_LEVEL);
+			if (ZSTD_isError(size))
+				throw std::runtime_error(std::string("zstd chunk compression failed: ") + ZSTD_getErrorName(size));
+			result.resize(size);
+			return result;
+		}
+#endif
+		default:
+			throw std::runtime_error("chunk compression codec was not compiled in");
+		}
+	}
+
+	// Inverse of compress_chunk(); "raw_size" is the uncompressed chunk size in bytes
+	inline std::vector<char> decompress_chunk(const std::vector<char>& data,
+		chunk_compression_t compression, std::size_t raw_size)
+	{
+		switch (compression) {
+		case CHUNK_COMPRESSION_NONE:
+			return data;
+#ifdef CMB_HAVE_ZLIB
+		case CHUNK_COMPRESSION_ZLIB: {
+			std::vector<char> result(raw_size);
+			uLongf size = static_cast<uLongf>(raw_size);
+			if (uncompress(reinterpret_cast<Bytef*>(result.data()), &size,
+					reinterpret_cast<const Bytef*>(data.data()), static_cast<uLong>(data.size())) != Z_OK
+				|| size != raw_size)
+				throw std::runtime_error("zlib chunk decompression failed");
+			return result;
+		}
+#endif
+#ifdef CMB_HAVE_ZSTD
+		case CHUNK_COMPRESSION_ZSTD: {
+			std::vector<char> result(raw_size);
+			std::size_t size = ZSTD_decompress(result.data(), result.size(), data.data(), data.size());
+			if (ZSTD_isError(size) || size != raw_size)
+				throw std::runtime_error("zstd chunk decompression failed");
+			return result;
+		}
+#endif
+		default:
+			throw std::runtime_error("chunk compression codec was not compiled in");
+		}
+	}
+
+	// Whether multi-byte values are stored least significant byte first
+	inline bool host_is_little_endian()
+	{
+		const uint16_t probe = 1;
+		unsigned char first;
+		std::memcpy(&first, &probe, 1);
+		return first == 1;
+	}
+
+	// Zarr data type string for label type T, e.g. "<u2". Chunks hold
+	// values in host byte order, so the string names the host's order.
+	template<typename T>
+	std::string zarr_dtype()
+	{
+		static_assert(std::is_arithmetic<T>::value, "chunked output needs arithmetic label values");
+		if (std::is_same<T, bool>::value)
+			return "|b1";
+		const char kind = std::is_floating_point<T>::value ? 'f' : (std::is_signed<T>::value ? 'i' : 'u');
+		const char* order = (sizeof(T) == 1) ? "|" : (host_is_little_endian() ? "<" : ">");
+		return std::string(order) + kind + std::to_string(sizeof(T));
+	}
+
+
+	/// WRITER: pyramid levels as chunk files in a Zarr (v2) style directory ///
+
+	/*
+		Class chunked_pyramid_writer_t stores each downsampled level as a
+		Zarr array in directory "<path>/<level>", one compressed file per
+		chunk, named by chunk grid index ("0.1.3"). Level numbers follow
+		parallel_downsample_all(), so "0" is the 1-downsampled image.
+
+		write_slab() may be called from several threads at once, and writes
+		every chunk the slab completes right away. Chunks straddling two
+		slabs are staged until both halves have arrived.
+
+		enqueue_slab() instead copies the slab into a queue; a pool of writer
+		threads compresses and writes it, so output overlaps with computing
+		the next levels. The queue holds at most a few slabs per writer
+		thread, so when writing falls behind, enqueue_slab() waits rather
+		than holding a second copy of the whole pyramid. Call finish() to
+		wait for the queue.
+	 */
+	template<typename ARRAY_TYPE>
+	class chunked_pyramid_writer_t
+	{
+	public:
+		static const std::size_t ndims = ARRAY_TYPE::dimensionality;
+		typedef typename ARRAY_TYPE::element label_t;
+		typedef boost::array<std::size_t, ndims> extents_t;
+		typedef label_slab_t<ARRAY_TYPE> slab_t;
+
+		// "original_extents" is the shape of the full resolution image
+		chunked_pyramid_writer_t(
+			const std::string& path,
+			const extents_t& original_extents,
+			const extents_t& chunk_extents,
+			chunk_compression_t compression = default_chunk_compression(),
+			std::size_t thread_count = std::max(1, QThread::idealThreadCount()))
+			: path_(path)
+			, original_extents_(original_extents)
+			, chunk_extents_(chunk_extents)
+			, compression_(compression)
+			, queue_capacity_(thread_count * CHUNK_WRITE_QUEUE_SLABS_PER_THREAD)
+			, closing_(false)
+		{
+			for (std::size_t d = 0; d < ndims; ++d) {
+				if (chunk_extents_[d] == 0)
+					throw std::invalid_argument("chunk extents must be positive");
+			}
+			if (thread_count == 0)
+				throw std::invalid_argument("chunked writer needs at least one writer thread");
+			make_directory(path_);
+			write_text_file(path_ + "/.zgroup", "{\"zarr_format\": 2}\n");
+			for (std::size_t t = 0; t < thread_count; ++t) {
+				threads_.emplace_back(new pinned_worker_t(cpu_list_t(), [this]() {drain_queue();}));
+				threads_.back()->start();
+			}
+		}
+
+		// Same, taking the level shapes from the image to be downsampled
+		chunked_pyramid_writer_t(
+			const std::string& path,
+			const ARRAY_TYPE& original,
+			const extents_t& chunk_extents,
+			chunk_compression_t compression = default_chunk_compression(),
+			std::size_t thread_count = std::max(1, QThread::idealThreadCount()))
+			: chunked_pyramid_writer_t(path, shape_of(original), chunk_extents, compression, thread_count)
+		{}
+
+		// Errors are only reported by finish(), so call it before this
+		~chunked_pyramid_writer_t()
+		{
+			try {
+				finish();
+			}
+			catch (...) {
+			}
+		}
+
+		// Store the chunks that "slab" completes, of pyramid level "level"
+		void write_slab(std::size_t level, const slab_t& slab)
+		{
+			check_slab(level, slab);
+			level_t& lvl = get_level(level);
+			const std::size_t row_end = slab.row_begin + slab.labels.size();
+			const std::size_t band_rows = chunk_extents_[0];
+			for (std::size_t b = slab.row_begin / band_rows; b * band_rows < row_end; ++b) {
+				band_t& band = *lvl.bands[b];
+				const std::size_t band_begin = b * band_rows;
+				const std::size_t band_end = std::min(band_begin + band_rows, lvl.extents[0]);
+				if (band_begin >= slab.row_begin && band_end <= row_end) {
+					write_band(level, lvl, b, slab.labels, slab.row_begin);
+					continue;
+				}
+				// Band straddles slabs: copy our rows in, and write once full
+				const std::size_t first = std::max(band_begin, slab.row_begin);
+				const std::size_t last = std::min(band_end, row_end);
+				QMutexLocker lock(&band.mutex);
+				if (band.rows.num_elements() == 0) {
+					extents_t band_extents = lvl.extents;
+					band_extents[0] = band_end - band_begin;
+					band.rows.resize(band_extents);
+				}
+				for (std::size_t r = first; r < last; ++r)
+					band.rows[r - band_begin] = slab.labels[r - slab.row_begin];
+				band.rows_filled += last - first;
+				if (band.rows_filled == band_end - band_begin) {
+					write_band(level, lvl, b, band.rows, band_begin);
+					band.rows.resize(extents_t());
+				}
+			}
+			lvl.rows_written += slab.labels.size();
+		}
+
+		// Store every slab of one level
+		void write_level(std::size_t level, const std::vector<slab_t>& slabs)
+		{
+			for (const slab_t& slab : slabs)
+				write_slab(level, slab);
+		}
+
+		// Queue a copy of "slab" for the writer threads. Waits while the queue
+		// is full, so a slow disk holds up the caller instead of piling up copies.
+		// Rethrows the first error a writer thread hit.
+		void enqueue_slab(std::size_t level, const slab_t& slab)
+		{
+			check_slab(level, slab);
+			std::shared_ptr<const slab_t> copy(new slab_t(slab));
+			QMutexLocker lock(&queue_mutex_);
+			while (queue_.size() >= queue_capacity_ && ! write_error_ && ! closing_)
+				queue_space_.wait(&queue_mutex_);
+			if (write_error_)
+				std::rethrow_exception(write_error_);
+			if (closing_)
+				throw std::logic_error("slab queued after finish()");
+			queue_.push_back(std::make_pair(level, copy));
+			queue_ready_.wakeOne();
+		}
+
+		// Wait until every queued slab is written, and stop the writer threads.
+		// Rethrows the first error a writer thread hit, and throws if a level
+		// got fewer rows than its shape holds, since its last chunks are missing.
+		void finish()
+		{
+			{
+				QMutexLocker lock(&queue_mutex_);
+				closing_ = true;
+				queue_ready_.wakeAll();
+				queue_space_.wakeAll();
+			}
+			for (auto& thread : threads_)
+				thread->wait();
+			std::vector<std::unique_ptr<pinned_worker_t> > threads;
+			threads.swap(threads_);
+			for (auto& thread : threads) {
+				if (thread->error())
+					std::rethrow_exception(thread->error());
+			}
+			if (write_error_)
+				std::rethrow_exception(write_error_);
+			QMutexLocker lock(&mutex_);
+			for (std::size_t level = 0; level < levels_.size(); ++level) {
+				if (levels_[level] && levels_[level]->rows_written != levels_[level]->extents[0])
+					throw std::runtime_error("pyramid level " + std::to_string(level) + " is missing rows");
+			}
+		}
+
+		// Callback for parallel_downsample_all(). Workers only copy their slab
+		// into the queue, so chunk writing holds up the next level only once
+		// the queue is full.
+		std::function<void(std::size_t, const slab_t&)> slab_callback()
+		{
+			return [this](std::size_t level, const slab_t& slab) {enqueue_slab(level, slab);};
+		}
+
+		const extents_t& chunk_extents() const {return chunk_extents_;}
+		chunk_compression_t compression() const {return compression_;}
+
+	private:
+		// Rows of one level sharing chunk index 0, staged when they straddle slabs
+		struct band_t
+		{
+			band_t() : rows_filled(0) {}
+
+			QMutex mutex;
+			ARRAY_TYPE rows;
+			std::size_t rows_filled;
+		};
+
+		struct level_t
+		{
+			level_t() : rows_written(0) {}
+
+			extents_t extents;
+			std::vector<std::unique_ptr<band_t> > bands;
+			std::atomic<std::size_t> rows_written;
+		};
+
+		// Writer thread loop: write queued slabs until finish() empties the queue.
+		// After an error the queue is dropped, and blocked callers are released
+		// to rethrow it, rather than waiting for space that never comes.
+		void drain_queue()
+		{
+			for (;;) {
+				std::pair<std::size_t, std::shared_ptr<const slab_t> > job;
+				{
+					QMutexLocker lock(&queue_mutex_);
+					while (queue_.empty() && ! closing_)
+						queue_ready_.wait(&queue_mutex_);
+					if (queue_.empty())
+						return;
+					job = queue_.front();
+					queue_.pop_front();
+					queue_space_.wakeOne();
+				}
+				try {
+					write_slab(job.first, *job.second);
+				}
+				catch (...) {
+					QMutexLocker lock(&queue_mutex_);
+					if (! write_error_)
+						write_error_ = std::current_exception();
+					queue_.clear();
+					queue_space_.wakeAll();
+				}
+			}
+		}
+
+		static void make_directory(const std::string& path)
+		{
+			if (! QDir().mkpath(QString::fromStdString(path)))
+				throw std::runtime_error("could not create directory " + path);
+		}
+
+		static void write_file(const std::string& path, const char* data, std::size_t size)
+		{
+			std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+			file.write(data, size);
+			if (! file)
+				throw std::runtime_error("could not write " + path);
+		}
+
+		static void write_text_file(const std::string& path, const std::string& text)
+		{
+			write_file(path, text.data(), text.size());
+		}
+
+		static std::string json_list(const extents_t& extents)
+		{
+			std::ostringstream json;
+			json << "[";
+			for (std::size_t d = 0; d < ndims; ++d)
+				json << (d > 0 ? ", " : "") << extents[d];
+			json << "]";
+			return json.str();
+		}
+
+		static extents_t shape_of(const ARRAY_TYPE& array)
+		{
+			extents_t result;
+			std::copy(array.shape(), array.shape() + ndims, result.begin());
+			return result;
+		}
+
+		// Shape of pyramid level "level", as parallel_downsample_all() makes it
+		extents_t level_extents(std::size_t level) const
+		{
+			extents_t result;
+			for (std::size_t d = 0; d < ndims; ++d)
+				result[d] = original_extents_[d] >> (level + 1);
+			return result;
+		}
+
+		// A slab shaped for some other image would overrun, or never complete, its chunks
+		void check_slab(std::size_t level, const slab_t& slab) const
+		{
+			const extents_t extents = level_extents(level);
+			bool fits = slab.row_begin + slab.labels.size() <= extents[0];
+			for (std::size_t d = 1; d < ndims; ++d)
+				fits = fits && (slab.labels.shape()[d] == extents[d]);
+			if (! fits)
+				throw std::invalid_argument("slab does not match the writer's shape for level " + std::to_string(level));
+		}
+
+		// Metadata and staging for a level are set up by its first slab
+		level_t& get_level(std::size_t level)
+		{
+			QMutexLocker lock(&mutex_);
+			if (level >= levels_.size())
+				levels_.resize(level + 1);
+			if (levels_[level])
+				return *levels_[level];
+
+			std::unique_ptr<level_t> lvl(new level_t());
+			lvl->extents = level_extents(level);
+			const std::size_t band_count = (lvl->extents[0] + chunk_extents_[0] - 1) / chunk_extents_[0];
+			for (std::size_t b = 0; b < band_count; ++b)
+				lvl->bands.emplace_back(new band_t());
+
+			const std::string level_path = path_ + "/" + std::to_string(level);
+			make_directory(level_path);
+			std::ostringstream zarray;
+			zarray << "{\n"
+				<< "    \"zarr_format\": 2,\n"
+				<< "    \"shape\": " << json_list(lvl->extents) << ",\n"
+				<< "    \"chunks\": " << json_list(chunk_extents_) << ",\n"
+				<< "    \"dtype\": \"" << zarr_dtype<label_t>() << "\",\n"
+				<< "    \"compressor\": " << zarr_compressor_json(compression_) << ",\n"
+				<< "    \"fill_value\": 0,\n"
+				<< "    \"order\": \"C\",\n"
+				<< "    \"filters\": null\n"
+				<< "}\n";
+			write_text_file(level_path + "/.zarray", zarray.str());
+
+			// List the levels written so far, finest first
+			std::ostringstream zattrs;
+			zattrs << "{\"multiscales\": [{\"name\": \"modal_downsample\", \"datasets\": [";
+			for (std::size_t l = 0; l < levels_.size(); ++l)
+				zattrs << (l > 0 ? ", " : "") << "{\"path\": \"" << l << "\"}";
+			zattrs << "]}]}\n";
+			write_text_file(path_ + "/.zattrs", zattrs.str());
+
+			levels_[level] = std::move(lvl);
+			return *levels_[level];
+		}
+
+		// Compress and write every chunk of band "b". "rows" holds the band,
+		// its row 0 being row "first_row" of the level.
+		void write_band(std::size_t level, const level_t& lvl, std::size_t b,
+			const ARRAY_TYPE& rows, std::size_t first_row)
+		{
+			extents_t grid;
+			for (std::size_t d = 0; d < ndims; ++d)
+				grid[d] = (lvl.extents[d] + chunk_extents_[d] - 1) / chunk_extents_[d];
+			std::size_t chunk_size = 1;
+			for (std::size_t d = 0; d < ndims; ++d)
+				chunk_size *= chunk_extents_[d];
+
+			// Rows are contiguous along the last dimension, so copy whole runs
+			const std::size_t last = ndims - 1;
+			assert(rows.strides()[last] == 1);
+
+			extents_t chunk = {};
+			chunk[0] = b;
+			std::vector<char> raw(chunk_size * sizeof(label_t));
+			for (;;) {
+				// Only part of an edge chunk lies inside the level; the rest
+				// keeps the fill value 0, as Zarr expects
+				extents_t origin, inside;
+				for (std::size_t d = 0; d < ndims; ++d) {
+					origin[d] = chunk[d] * chunk_extents_[d];
+					inside[d] = std::min(chunk_extents_[d], lvl.extents[d] - origin[d]);
+				}
+				std::fill(raw.begin(), raw.end(), 0);
+
+				// One run per index of the leading dimensions within the chunk
+				extents_t run = {};
+				for (;;) {
+					std::ptrdiff_t source = static_cast<std::ptrdiff_t>(origin[last] - (last == 0 ? first_row : 0));
+					std::size_t target = 0;
+					for (std::size_t d = 0; d < last; ++d) {
+						const std::size_t g = origin[d] + run[d] - (d == 0 ? first_row : 0);
+						source += static_cast<std::ptrdiff_t>(g) * rows.strides()[d];
+						target = (target + run[d]) * chunk_extents_[d + 1];
+					}
+					std::memcpy(raw.data() + target * sizeof(label_t),
+						rows.data() + source, inside[last] * sizeof(label_t));
+
+					bool done = true;
+					for (std::size_t d = last; d-- > 0; ) {
+						if (++run[d] < inside[d]) {
+							done = false;
+							break;
+						}
+						run[d] = 0;
+					}
+					if (done)
+						break;
+				}
+				const std::vector<char> data = compress_chunk(raw, compression_);
+
+				std::ostringstream name;
+				name << path_ << "/" << level << "/";
+				for (std::size_t d = 0; d < ndims; ++d)
+					name << (d > 0 ? "." : "") << chunk[d];
+				write_file(name.str(), data.data(), data.size());
+
+				// Next chunk in this band, last dimension fastest
+				std::size_t d = ndims;
+				while (--d > 0) {
+					if (++chunk[d] < grid[d])
+						break;
+					chunk[d] = 0;
+				}
+				if (d == 0)
+					break;
+			}
+		}
+
+		std::string path_;
+		extents_t original_extents_;
+		extents_t chunk_extents_;
+		chunk_compression_t compression_;
+		QMutex mutex_;
+		std::vector<std::unique_ptr<level_t> > levels_;
+
+		QMutex queue_mutex_;
+		QWaitCondition queue_ready_;
+		QWaitCondition queue_space_;
+		std::deque<std::pair<std::size_t, std::shared_ptr<const slab_t> > > queue_;
+		std::size_t queue_capacity_;
+		std::exception_ptr write_error_;
+		bool closing_;
+		std::vector<std::unique_ptr<pinned_worker_t> > threads_;
+	};
+
+} // namespace cmb
+
+#endif // CMB_CHUNKED_WRITER_HPP_
@@ -27,6 +27,9 @@ SOFTWARE.
 #include <iostream>
 #include <vector>
 #include <unordered_map>
+#include <cassert>
+#include <cstdint>
+#include <functional>
 
 #include <boost/multi_array.hpp>
 
@@ -53,13 +56,30 @@ namespace cmb {
 		{}
 
 		const label_t& get_mode() const {return cached_mode_label;}
+		const count_t& get_mode_count() const {return cached_mode_count;}
+
+		// Tie rule for modes: the higher count wins, then the lower label.
+		// This makes the mode independent of the order labels were counted in,
+		// so serial and parallel merges agree.
+		static bool is_better_mode(const count_t& count, const label_t& label,
+			const count_t& best_count, const label_t& best_label) {
+			return count > best_count || (count == best_count && label < best_label);
+		}
+
+		// Which of "partition_count" disjoint partitions of the label space
+		// this label belongs to. Labels are scrambled first (Fibonacci hashing),
+		// so regularly spaced label values still spread over every partition.
+		static std::size_t partition_of(const label_t& label, std::size_t partition_count) {
+			const std::uint64_t h = std::hash<label_t>()(label) * 0x9E3779B97F4A7C15ull;
+			return static_cast<std::size_t>(h >> 32) % partition_count;
+		}
 
 		// Increment raw label value counts
 		void agglomerate_scalar(const label_t& label, const count_t& inc = 1) {
 			map_[label] += inc;
 			// cache mode value, so we can access mode in constant time
 			const count_t& c = map_[label];
-			if (c > cached_mode_count) {
+			if (is_better_mode(c, label, cached_mode_count, cached_mode_label)) {
 				cached_mode_count = c;
 				cached_mode_label = label;
 			}
@@ -74,6 +94,16 @@ namespace cmb {
 			}
 		}
 
+		// Number of distinct labels counted so far
+		std::size_t label_count() const {return map_.size();}
+
+		// Call visit(label, count) for every distinct label
+		template<typename VISITOR>
+		void for_each_label(VISITOR visit) const {
+			for (const auto& entry : map_)
+				visit(entry.first, entry.second);
+		}
+
 	private:
 		std::unordered_map<label_t, count_t> map_;
 		count_t cached_mode_count;
@@ -104,18 +134,20 @@ namespace cmb {
 			assert(ORIGINAL_ARRAY_TYPE::dimensionality == DIMENSIONALITY);
 			assert(original.size() == 2 * result.size());
 			typedef typename RESULT_ARRAY_TYPE::reference result_subarray_t;
-			typedef typename ORIGINAL_ARRAY_TYPE::value_type original_subarray_t;
+			typedef typename ORIGINAL_ARRAY_TYPE::const_reference original_subarray_t;
 			for (std::size_t i = 0; i < result.size(); ++i) {
+				// subarrays are views, so writes through this local reach "result"
+				result_subarray_t result_i = result[i];
 				ArrayDownsampler<
 					result_subarray_t,
 					original_subarray_t,
 					DIMENSIONALITY - 1>
-					::downsample_array(result[i], original[2*i]);
+					::downsample_array(result_i, original[2*i]);
 				ArrayDownsampler<
 					result_subarray_t,
 					original_subarray_t, 
 					DIMENSIONALITY - 1>
-					::downsample_array(result[i], original[2*i + 1]);
+					::downsample_array(result_i, original[2*i + 1]);
 			}
 		}
 	};
@@ -135,6 +167,16 @@ namespace cmb {
 		}
 	};
 
+	// 0-dimensional specialization, for downsampling one row at a time
+	template<typename RESULT_ARRAY_TYPE, typename ORIGINAL_ARRAY_TYPE>
+	struct ArrayDownsampler<RESULT_ARRAY_TYPE, ORIGINAL_ARRAY_TYPE, 0>
+	{
+		static void downsample_array(RESULT_ARRAY_TYPE& result, const ORIGINAL_ARRAY_TYPE& original)
+		{
+			result.agglomerate_scalar(original);
+		}
+	};
+
 	// Easier-to-call delegate to ArrayDownsampler class
 	template<typename RESULT_ARRAY_TYPE, typename ORIGINAL_ARRAY_TYPE>
 	void downsample_array(RESULT_ARRAY_TYPE& result, const ORIGINAL_ARRAY_TYPE& original)
@@ -155,13 +197,14 @@ namespace cmb {
 			assert(ORIGINAL_ARRAY_TYPE::dimensionality == DIMENSIONALITY);
 			assert(original.size() == result.size());
 			typedef typename RESULT_ARRAY_TYPE::reference result_subarray_t;
-			typedef typename ORIGINAL_ARRAY_TYPE::value_type original_subarray_t;
+			typedef typename ORIGINAL_ARRAY_TYPE::const_reference original_subarray_t;
 			for (std::size_t i = 0; i < result.size(); ++i) {
+				result_subarray_t result_i = result[i];
 				ArrayRenderer<
 					result_subarray_t,
 					original_subarray_t,
 					DIMENSIONALITY - 1>
-					::render_array(result[i], original[i]);
+					::render_array(result_i, original[i]);
 			}
 		}
 	};
@@ -204,7 +247,7 @@ namespace cmb {
 			smallest_dimension = std::min(dim, smallest_dimension);
 			extents.push_back(dim / 2);
 		}
-		typedef boost::multi_array<histogram_t<ARRAY_TYPE::value_type>, ndims> hist_t;
+		typedef boost::multi_array<histogram_t<typename ARRAY_TYPE::element>, ndims> hist_t;
 		hist_t hist(extents);
 		downsample_array(hist, original);
 
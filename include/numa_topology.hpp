@@ -0,0 +1,151 @@
+#ifndef CMB_NUMA_TOPOLOGY_HPP_
+#define CMB_NUMA_TOPOLOGY_HPP_
+
+// (MIT license)
+/*
+Copyright(c) 2017 Christopher M. Bruns
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <QThread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace cmb {
+
+	typedef std::vector<int> cpu_list_t;
+
+	// Parse a Linux sysfs cpu list, such as "0-3,8-11", into cpu numbers
+	inline cpu_list_t parse_cpu_list(const std::string& text)
+	{
+		cpu_list_t result;
+		std::istringstream stream(text);
+		std::string range;
+		while (std::getline(stream, range, ',')) {
+			if (range.empty() || range == "\n")
+				continue;
+			std::size_t dash = range.find('-');
+			int first = std::stoi(range.substr(0, dash));
+			int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+			for (int cpu = first; cpu <= last; ++cpu)
+				result.push_back(cpu);
+		}
+		return result;
+	}
+
+	/*
+		Class numa_topology_t lists the cpus belonging to each NUMA node,
+		so worker threads can be pinned next to the memory they touch.
+		Machines without NUMA information look like one node.
+	 */
+	class numa_topology_t
+	{
+	public:
+		explicit numa_topology_t(const std::vector<cpu_list_t>& nodes)
+			: nodes_(nodes)
+		{}
+
+		std::size_t node_count() const {return nodes_.size();}
+		const cpu_list_t& cpus(std::size_t node) const {return nodes_[node];}
+
+		// Total number of cpus, across all nodes
+		std::size_t cpu_count() const {
+			std::size_t result = 0;
+			for (const cpu_list_t& node : nodes_)
+				result += node.size();
+			return result;
+		}
+
+		// Query the nodes on this machine, keeping only the cpus this process may run on
+		static numa_topology_t detect()
+		{
+			std::vector<cpu_list_t> nodes;
+#ifdef __linux__
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			sched_getaffinity(0, sizeof(allowed), &allowed);
+			std::string online;
+			std::ifstream online_file("/sys/devices/system/node/online");
+			std::getline(online_file, online);
+			for (int node : parse_cpu_list(online)) {
+				std::ifstream cpu_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				std::string text;
+				std::getline(cpu_file, text);
+				cpu_list_t cpus;
+				for (int cpu : parse_cpu_list(text)) {
+					if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+						cpus.push_back(cpu);
+				}
+				if (! cpus.empty())
+					nodes.push_back(cpus);
+			}
+			if (nodes.empty()) {
+				cpu_list_t cpus;
+				for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+					if (CPU_ISSET(cpu, &allowed))
+						cpus.push_back(cpu);
+				}
+				if (! cpus.empty())
+					nodes.push_back(cpus);
+			}
+#endif
+			if (nodes.empty()) {
+				cpu_list_t cpus;
+				for (int cpu = 0; cpu < std::max(1, QThread::idealThreadCount()); ++cpu)
+					cpus.push_back(cpu);
+				nodes.push_back(cpus);
+			}
+			return numa_topology_t(nodes);
+		}
+
+	private:
+		std::vector<cpu_list_t> nodes_;
+	};
+
+	// Restrict the calling thread to the given cpus.
+	// Returns false where pinning is unsupported or refused.
+	inline bool pin_current_thread(const cpu_list_t& cpus)
+	{
+#ifdef __linux__
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		for (int cpu : cpus) {
+			if (cpu >= 0 && cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &mask);
+		}
+		return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+		(void)cpus;
+		return false;
+#endif
+	}
+
+} // namespace cmb
+
+#endif // CMB_NUMA_TOPOLOGY_HPP_
@@ -0,0 +1,446 @@
+#ifndef CMB_PARALLEL_DOWNSAMPLE_HPP_
+#define CMB_PARALLEL_DOWNSAMPLE_HPP_
+
+// (MIT license)
+/*
+Copyright(c) 2017 Christopher M. Bruns
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QThread>
+#include <boost/array.hpp>
+#include <boost/multi_array.hpp>
+
+#include "modal_downsample.hpp"
+#include "numa_topology.hpp"
+#include "performance_parameters.hpp"
+
+namespace cmb {
+
+	/*
+		Class label_slab_t holds a contiguous range of rows, along dimension 0,
+		of one rendered pyramid level. The "labels" buffer is allocated and
+		filled by a worker pinned to "node", so its pages live on that node.
+	 */
+	template<typename ARRAY_TYPE>
+	struct label_slab_t
+	{
+		std::size_t row_begin; // first row of this slab within its level
+		std::size_t node;
+		ARRAY_TYPE labels;
+	};
+
+	/*
+		Class histogram_slab_t holds the label counts behind one label_slab_t.
+		It is only kept until the next pyramid level has been agglomerated.
+	 */
+	template<typename ARRAY_TYPE>
+	struct histogram_slab_t
+	{
+		typedef boost::multi_array<
+			histogram_t<typename ARRAY_TYPE::element>,
+			ARRAY_TYPE::dimensionality> hist_array_t;
+
+		std::size_t row_begin;
+		std::size_t row_end;
+		hist_array_t histograms;
+	};
+
+
+	/// THREADING: one worker per cpu, pinned to its NUMA node ///
+
+	// An empty cpu list leaves the thread unpinned
+	class pinned_worker_t : public QThread
+	{
+	public:
+		pinned_worker_t(const cpu_list_t& cpus, const std::function<void()>& job)
+			: cpus_(cpus)
+			, job_(job)
+		{}
+
+		// Whatever the job threw, if anything
+		const std::exception_ptr& error() const {return error_;}
+
+	protected:
+		void run() override {
+#if PIN_WORKER_THREADS
+			// Must happen before the job allocates anything, so first touch lands locally
+			if (! cpus_.empty())
+				pin_current_thread(cpus_);
+#endif
+			// Exceptions must not escape a QThread; hand them back to the caller
+			try {
+				job_();
+			}
+			catch (...) {
+				error_ = std::current_exception();
+			}
+		}
+
+	private:
+		cpu_list_t cpus_;
+		std::function<void()> job_;
+		std::exception_ptr error_;
+	};
+
+	// Call job(worker, node) once per cpu in the topology, in parallel,
+	// and wait for all of them. Workers are numbered node by node.
+	// The first exception thrown by any job is rethrown here.
+	inline void run_pinned_workers(
+		const numa_topology_t& topology,
+		const std::function<void(std::size_t worker, std::size_t node)>& job)
+	{
+		std::vector<std::unique_ptr<pinned_worker_t> > workers;
+		for (std::size_t node = 0; node < topology.node_count(); ++node) {
+			for (std::size_t c = 0; c < topology.cpus(node).size(); ++c) {
+				const std::size_t worker = workers.size();
+				workers.emplace_back(new pinned_worker_t(
+					topology.cpus(node),
+					[&job, worker, node]() {job(worker, node);}));
+			}
+		}
+		for (auto& worker : workers)
+			worker->start();
+		for (auto& worker : workers)
+			worker->wait();
+		for (auto& worker : workers) {
+			if (worker->error())
+				std::rethrow_exception(worker->error());
+		}
+	}
+
+
+	/// ROW SOURCES: where a slab reads rows of the previous level from ///
+
+	// Rows of the caller's original array
+	template<typename ARRAY_TYPE>
+	struct array_row_source_t
+	{
+		typedef typename ARRAY_TYPE::const_reference row_t;
+
+		row_t operator()(std::size_t row) const {return array[row];}
+
+		const ARRAY_TYPE& array;
+	};
+
+	// Rows of a slab-partitioned histogram level. A slab may need the
+	// last row of its neighbor, when that neighbor holds an odd row count.
+	template<typename ARRAY_TYPE>
+	struct histogram_slab_row_source_t
+	{
+		typedef histogram_slab_t<ARRAY_TYPE> slab_t;
+		typedef typename slab_t::hist_array_t::const_reference row_t;
+
+		row_t operator()(std::size_t row) const {
+			// last slab starting at or before "row"; empty slabs never match
+			auto slab = std::upper_bound(slabs.begin(), slabs.end(), row,
+				[](std::size_t r, const slab_t& s) {return r < s.row_begin;});
+			--slab;
+			return slab->histograms[row - slab->row_begin];
+		}
+
+		const std::vector<slab_t>& slabs;
+	};
+
+	// Agglomerate pairs of input rows into "result", which holds the rows
+	// starting at "row_begin" of the downsampled level
+	template<typename HIST_ARRAY_TYPE, typename ROW_SOURCE>
+	void downsample_rows(HIST_ARRAY_TYPE& result, std::size_t row_begin, const ROW_SOURCE& input_row)
+	{
+		typedef typename HIST_ARRAY_TYPE::reference result_row_t;
+		typedef typename ROW_SOURCE::row_t original_row_t;
+		const int row_dimensionality = HIST_ARRAY_TYPE::dimensionality - 1;
+		for (std::size_t i = 0; i < result.size(); ++i) {
+			result_row_t result_i = result[i];
+			const std::size_t row = 2 * (row_begin + i);
+			ArrayDownsampler<result_row_t, original_row_t, row_dimensionality>
+				::downsample_array(result_i, input_row(row));
+			ArrayDownsampler<result_row_t, original_row_t, row_dimensionality>
+				::downsample_array(result_i, input_row(row + 1));
+		}
+	}
+
+
+	/// PARTITIONED REDUCTION: one hash partition of the labels per worker ///
+
+	// Split one slab's histograms by label partition, in a single pass.
+	// Each label goes to the same pixel of (*buckets[p]), where p is its
+	// partition; every bucket must already have the slab's shape.
+	template<typename SLAB_TYPE>
+	void scatter_histogram_slab(const std::vector<SLAB_TYPE*>& buckets, const SLAB_TYPE& slab)
+	{
+		typedef typename SLAB_TYPE::hist_array_t::element hist_t;
+		const std::size_t partition_count = buckets.size();
+		std::vector<hist_t*> destinations;
+		for (SLAB_TYPE* bucket : buckets)
+			destinations.push_back(bucket->histograms.data());
+		const hist_t* source = slab.histograms.data();
+		for (std::size_t i = 0; i < slab.histograms.num_elements(); ++i) {
+			source[i].for_each_label([&](const typename hist_t::label_t& label, const typename hist_t::count_t& count) {
+				destinations[hist_t::partition_of(label, partition_count)][i].agglomerate_scalar(label, count);
+			});
+		}
+	}
+
+	// Mean number of distinct labels per pixel of the next level up
+	template<typename SLAB_TYPE>
+	double labels_per_downsampled_pixel(const std::vector<SLAB_TYPE>& slabs, std::size_t pixel_count)
+	{
+		std::size_t labels = 0;
+		for (const SLAB_TYPE& slab : slabs) {
+			for (std::size_t i = 0; i < slab.histograms.num_elements(); ++i)
+				labels += slab.histograms.data()[i].label_count();
+		}
+		return double(labels) / pixel_count;
+	}
+
+	// Render the rows starting at "row_begin" of a partitioned level. Each
+	// partition already knows its own mode, so a pixel's mode is just the
+	// most frequent of those, using the same tie rule as histogram_t.
+	template<typename RESULT_ARRAY_TYPE, typename HIST_ARRAY_TYPE>
+	void render_partitioned_rows(RESULT_ARRAY_TYPE& result, std::size_t row_begin,
+		const std::vector<HIST_ARRAY_TYPE>& partitions)
+	{
+		typedef typename HIST_ARRAY_TYPE::element hist_t;
+		const std::size_t offset = row_begin * (result.num_elements() / result.size());
+		for (std::size_t i = 0; i < result.num_elements(); ++i) {
+			const auto* best = partitions[0].data() + offset + i;
+			for (const HIST_ARRAY_TYPE& partition : partitions) {
+				const auto* candidate = partition.data() + offset + i;
+				if (hist_t::is_better_mode(candidate->get_mode_count(), candidate->get_mode(),
+						best->get_mode_count(), best->get_mode()))
+					best = candidate;
+			}
+			result.data()[i] = best->get_mode();
+		}
+	}
+
+
+	/// PYRAMID: all downsampled levels, one slab per worker ///
+
+	// Copy the slabs of one level into a single contiguous array
+	template<typename ARRAY_TYPE>
+	ARRAY_TYPE assemble_level(const std::vector<label_slab_t<ARRAY_TYPE> >& slabs)
+	{
+		const std::size_t ndims = ARRAY_TYPE::dimensionality;
+		boost::array<std::size_t, ndims> extents;
+		const ARRAY_TYPE& last = slabs.back().labels;
+		std::copy(last.shape(), last.shape() + ndims, extents.begin());
+		extents[0] += slabs.back().row_begin;
+		ARRAY_TYPE result(extents);
+		for (const auto& slab : slabs) {
+			for (std::size_t i = 0; i < slab.labels.size(); ++i)
+				result[slab.row_begin + i] = slab.labels[i];
+		}
+		return result;
+	}
+
+	// Create all downsampled levels of "original", in parallel.
+	// Each level is split along dimension 0 into one slab per cpu, grouped
+	// by NUMA node. Every slab's histograms and labels are allocated by the
+	// pinned worker that fills them, and the next level's slab is computed
+	// by the same worker, so the data stays on one node all the way up.
+	// The original array is read exactly once, so it is used in place.
+	//
+	// Near the top of the pyramid there are too few rows to keep every
+	// worker busy, while each histogram may hold very many labels. Once a
+	// level has fewer nonempty slabs than workers, at most
+	// PARTITIONED_REDUCTION_MAX_PIXELS pixels, and at least
+	// PARTITIONED_REDUCTION_MIN_LABELS labels per pixel to merge, it and
+	// all levels above it are reduced by label instead: worker p keeps the
+	// labels that hash to partition p, for every pixel, and merges only
+	// those. At the switch, each slab owner first scatters its histograms
+	// into one bucket per partition, so every label is hashed just once.
+	// The first level is always done by slab, since its histograms can hold
+	// no more labels than a block has pixels.
+	//
+	// If given, "on_slab_rendered(level, slab)" is called by each worker as
+	// soon as its slab of a level is rendered. It runs inside the worker, and
+	// the next level waits for it, so it should hand slow work such as
+	// writing elsewhere. "slab" may only be used during the call; copy it to
+	// keep it. chunked_pyramid_writer_t::slab_callback() copies each slab
+	// into a bounded queue, so a slow disk eventually holds up the workers.
+	// It must be safe to call from several threads at once.
+	template<typename ARRAY_TYPE>
+	std::vector<std::vector<label_slab_t<ARRAY_TYPE> > > parallel_downsample_all(
+		const ARRAY_TYPE& original,
+		const numa_topology_t& topology = numa_topology_t::detect(),
+		const std::function<void(std::size_t level, const label_slab_t<ARRAY_TYPE>& slab)>& on_slab_rendered
+			= std::function<void(std::size_t level, const label_slab_t<ARRAY_TYPE>& slab)>())
+	{
+		const std::size_t ndims = ARRAY_TYPE::dimensionality;
+		typedef label_slab_t<ARRAY_TYPE> label_slab_type;
+		typedef histogram_slab_t<ARRAY_TYPE> hist_slab_type;
+		typedef typename hist_slab_type::hist_array_t hist_array_type;
+
+		std::vector<std::vector<label_slab_type> > result;
+
+		boost::array<std::size_t, ndims> extents;
+		std::copy(original.shape(), original.shape() + ndims, extents.begin());
+
+		const std::size_t worker_count = topology.cpu_count();
+		std::vector<hist_slab_type> previous(worker_count);
+		std::vector<hist_slab_type> current(worker_count);
+		std::vector<hist_array_type> previous_partitions(worker_count);
+		std::vector<hist_array_type> current_partitions(worker_count);
+		bool partitioned = false;
+		const boost::array<std::size_t, ndims> no_extents = {};
+
+		for (;;) {
+			// Stop once any dimension can no longer be halved
+			bool can_halve = true;
+			for (std::size_t d = 0; d < ndims; ++d)
+				can_halve = can_halve && (extents[d] >= 2) && (extents[d] % 2 == 0);
+			if (! can_halve)
+				break;
+			const boost::array<std::size_t, ndims> previous_extents = extents;
+			std::size_t pixel_count = 1;
+			for (std::size_t d = 0; d < ndims; ++d) {
+				extents[d] /= 2;
+				pixel_count *= extents[d];
+			}
+
+			// Partition rows; higher levels halve the slabs below them
+			const bool first_level = result.empty();
+			for (std::size_t w = 0; w < worker_count; ++w) {
+				if (first_level) {
+					current[w].row_begin = extents[0] * w / worker_count;
+					current[w].row_end = extents[0] * (w + 1) / worker_count;
+				}
+				else {
+					current[w].row_begin = previous[w].row_begin / 2;
+					current[w].row_end = previous[w].row_end / 2;
+				}
+			}
+
+			// Workers whose slab came out empty contribute nothing to this level
+			const std::size_t no_slab = worker_count;
+			std::vector<std::size_t> level_index(worker_count, no_slab);
+			std::size_t slab_count = 0;
+			for (std::size_t w = 0; w < worker_count; ++w) {
+				if (current[w].row_end > current[w].row_begin)
+					level_index[w] = slab_count++;
+			}
+
+			const bool was_partitioned = partitioned;
+			partitioned = partitioned
+				|| (! first_level
+					&& slab_count < worker_count
+					&& pixel_count <= PARTITIONED_REDUCTION_MAX_PIXELS
+					&& labels_per_downsampled_pixel(previous, pixel_count) >= PARTITIONED_REDUCTION_MIN_LABELS);
+
+			std::vector<label_slab_type> level(slab_count);
+			if (partitioned) {
+				// Scatter: buckets[p][w] holds the partition p labels of slab w
+				std::vector<std::vector<hist_slab_type> > buckets;
+				if (! was_partitioned) {
+					buckets.assign(worker_count, std::vector<hist_slab_type>(worker_count));
+					run_pinned_workers(topology, [&](std::size_t w, std::size_t) {
+						current[w].histograms.resize(no_extents);
+						boost::array<std::size_t, ndims> slab_extents = previous_extents;
+						slab_extents[0] = previous[w].row_end - previous[w].row_begin;
+						std::vector<hist_slab_type*> slab_buckets;
+						for (std::size_t p = 0; p < worker_count; ++p) {
+							hist_slab_type& bucket = buckets[p][w];
+							bucket.row_begin = previous[w].row_begin;
+							bucket.row_end = previous[w].row_end;
+							bucket.histograms.resize(slab_extents);
+							slab_buckets.push_back(&bucket);
+						}
+						scatter_histogram_slab(slab_buckets, previous[w]);
+						previous[w].histograms.resize(no_extents);
+					});
+				}
+				// Reduce: each worker merges its own partition of every pixel
+				run_pinned_workers(topology, [&](std::size_t p, std::size_t) {
+					hist_array_type& partition = current_partitions[p];
+					partition.resize(no_extents);
+					partition.resize(extents);
+					if (was_partitioned) {
+						downsample_array(partition, previous_partitions[p]);
+					}
+					else {
+						histogram_slab_row_source_t<ARRAY_TYPE> source = {buckets[p]};
+						downsample_rows(partition, 0, source);
+						for (hist_slab_type& bucket : buckets[p])
+							bucket.histograms.resize(no_extents);
+					}
+				});
+				// Argmax: each slab's pixels take the best of the partition modes
+				run_pinned_workers(topology, [&](std::size_t w, std::size_t node) {
+					if (level_index[w] == no_slab)
+						return;
+					boost::array<std::size_t, ndims> slab_extents = extents;
+					slab_extents[0] = current[w].row_end - current[w].row_begin;
+					label_slab_type& labels = level[level_index[w]];
+					labels.row_begin = current[w].row_begin;
+					labels.node = node;
+					labels.labels.resize(slab_extents);
+					render_partitioned_rows(labels.labels, labels.row_begin, current_partitions);
+					if (on_slab_rendered)
+						on_slab_rendered(result.size(), labels);
+				});
+				std::swap(previous_partitions, current_partitions);
+			}
+			else {
+				run_pinned_workers(topology, [&](std::size_t w, std::size_t node) {
+					hist_slab_type& slab = current[w];
+					// Release this worker's histograms from two levels down,
+					// before allocating the new ones in their place
+					slab.histograms.resize(no_extents);
+					boost::array<std::size_t, ndims> slab_extents = extents;
+					slab_extents[0] = slab.row_end - slab.row_begin;
+					slab.histograms.resize(slab_extents);
+					if (first_level) {
+						array_row_source_t<ARRAY_TYPE> source = {original};
+						downsample_rows(slab.histograms, slab.row_begin, source);
+					}
+					else {
+						histogram_slab_row_source_t<ARRAY_TYPE> source = {previous};
+						downsample_rows(slab.histograms, slab.row_begin, source);
+					}
+					if (level_index[w] == no_slab)
+						return;
+					label_slab_type& labels = level[level_index[w]];
+					labels.row_begin = slab.row_begin;
+					labels.node = node;
+					labels.labels.resize(slab_extents);
+					render_array(labels.labels, slab.histograms);
+					if (on_slab_rendered)
+						on_slab_rendered(result.size(), labels);
+				});
+			}
+
+			result.push_back(std::move(level));
+			std::swap(previous, current);
+		}
+
+		return result;
+	}
+
+} // namespace cmb
+
+#endif // CMB_PARALLEL_DOWNSAMPLE_HPP_
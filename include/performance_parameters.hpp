@@ -39,6 +39,32 @@ SOFTWARE.
 // worth testing...
 #define DO_CACHE_MODE_VALUE 1
 
+// Pin each worker thread to the cpus of the NUMA node whose slab it
+// processes, so first-touch allocation keeps every pyramid level node-local.
+// Turning this off lets the scheduler migrate workers away from their memory.
+#define PIN_WORKER_THREADS 1
+
+// Top pyramid levels have few pixels, but possibly huge histograms. Once
+// there are fewer rows than workers, levels with at most this many pixels
+// are merged by label partition rather than by pixel. Each worker then
+// holds one (mostly empty) histogram per pixel, so keep this modest.
+#define PARTITIONED_REDUCTION_MAX_PIXELS 4096
+
+// ...and only when the histograms below hold at least this many distinct
+// labels per pixel being merged. With fewer, scattering them by partition
+// costs more than the parallel merge saves.
+#define PARTITIONED_REDUCTION_MIN_LABELS 256
+
+// Compression level for chunked output, for both zlib and zstd. Low levels
+// keep compression from becoming the bottleneck; label images with much
+// spatial coherence compress well even so.
+#define CHUNK_COMPRESSION_LEVEL 1
+
+// Slabs queued per chunk writer thread before callers wait for space.
+// Each queued slab is a copy, so this bounds the memory spent on output
+// when the disk is slower than downsampling.
+#define CHUNK_WRITE_QUEUE_SLABS_PER_THREAD 2
+
 // Other things to test:
 // * std::unordered_map vs std::map
 // * number of shards per parallel work unit
@@ -0,0 +1,47 @@
+#ifndef CMB_FAKE_TOPOLOGY_HPP_
+#define CMB_FAKE_TOPOLOGY_HPP_
+
+// (MIT license)
+/*
+Copyright(c) 2017 Christopher M. Bruns
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// local headers
+#include "numa_topology.hpp"
+
+// standard headers
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+// Pretend the machine has one NUMA node per entry of "workers_per_node",
+// each with that many workers. Every worker is pinned to the same cpu we
+// may really use, so any shape runs anywhere, just not in parallel.
+inline cmb::numa_topology_t fake_topology(std::initializer_list<std::size_t> workers_per_node)
+{
+	const cmb::cpu_list_t cpus = cmb::numa_topology_t::detect().cpus(0);
+	std::vector<cmb::cpu_list_t> nodes;
+	for (std::size_t workers : workers_per_node)
+		nodes.push_back(cmb::cpu_list_t(workers, cpus[0]));
+	return cmb::numa_topology_t(nodes);
+}
+
+#endif // CMB_FAKE_TOPOLOGY_HPP_
@@ -0,0 +1,230 @@
+// (MIT license)
+/*
+Copyright(c) 2017 Christopher M. Bruns
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Stifle MSVC unchecked iterator warning
+#pragma warning( disable : 4996 )
+
+// local headers
+#include "chunked_writer.hpp"
+#include "fake_topology.hpp"
+#include "parallel_downsample.hpp"
+
+// third party headers
+#include <QDir>
+#include <QString>
+
+// standard headers
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define BOOST_TEST_MODULE ChunkedWriter
+
+//VERY IMPORTANT - include this last
+#include <boost/test/unit_test.hpp>
+
+typedef uint16_t label_t;
+typedef boost::multi_array<label_t, 3> array_t;
+typedef cmb::chunked_pyramid_writer_t<array_t> writer_t;
+
+std::vector<char> read_file(const std::string& path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	BOOST_REQUIRE_MESSAGE(file, "missing " + path);
+	return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void check_contains(const std::string& path, const std::string& expected)
+{
+	const std::vector<char> bytes = read_file(path);
+	const std::string text(bytes.begin(), bytes.end());
+	BOOST_CHECK_MESSAGE(text.find(expected) != std::string::npos, path + " lacks " + expected);
+}
+
+// Rebuild one level from its chunk files, the way a Zarr reader would
+array_t read_level(const std::string& path, const writer_t& writer, std::size_t level, const array_t& like)
+{
+	const writer_t::extents_t& chunk = writer.chunk_extents();
+	const std::size_t chunk_size = chunk[0] * chunk[1] * chunk[2];
+	array_t result(boost::extents[like.shape()[0]][like.shape()[1]][like.shape()[2]]);
+	for (std::size_t i = 0; i * chunk[0] < result.shape()[0]; ++i)
+	for (std::size_t j = 0; j * chunk[1] < result.shape()[1]; ++j)
+	for (std::size_t k = 0; k * chunk[2] < result.shape()[2]; ++k) {
+		std::ostringstream name;
+		name << path << "/" << level << "/" << i << "." << j << "." << k;
+		std::vector<char> raw = cmb::decompress_chunk(
+			read_file(name.str()), writer.compression(), chunk_size * sizeof(label_t));
+		const label_t* values = reinterpret_cast<const label_t*>(raw.data());
+		for (std::size_t a = 0; a < chunk[0]; ++a)
+		for (std::size_t b = 0; b < chunk[1]; ++b)
+		for (std::size_t c = 0; c < chunk[2]; ++c) {
+			const label_t value = values[(a * chunk[1] + b) * chunk[2] + c];
+			const std::size_t x = i * chunk[0] + a, y = j * chunk[1] + b, z = k * chunk[2] + c;
+			if (x < result.shape()[0] && y < result.shape()[1] && z < result.shape()[2])
+				result[x][y][z] = value;
+			else
+				BOOST_CHECK_EQUAL(value, 0); // edge chunks are padded with the fill value
+		}
+	}
+	return result;
+}
+
+void check_round_trip(const std::string& path, cmb::chunk_compression_t compression)
+{
+	QDir(QString::fromStdString(path)).removeRecursively();
+
+	array_t original(boost::extents[24][8][16]);
+	std::srand(7);
+	for (label_t* p = original.data(); p != original.data() + original.num_elements(); ++p)
+		*p = 1 + std::rand() % 4;
+
+	// Uneven chunks, so some span two slabs and some hang off the edge
+	writer_t::extents_t chunk_extents = {{5, 3, 4}};
+	writer_t writer(path, original, chunk_extents, compression);
+
+	auto levels = cmb::parallel_downsample_all(original, fake_topology({2, 1}), writer.slab_callback());
+	BOOST_REQUIRE_EQUAL(levels.size(), 3);
+	writer.finish();
+
+	check_contains(path + "/.zgroup", "\"zarr_format\": 2");
+	check_contains(path + "/.zattrs", "\"datasets\": [{\"path\": \"0\"}, {\"path\": \"1\"}, {\"path\": \"2\"}]");
+	const char* compressor_id =
+		compression == cmb::CHUNK_COMPRESSION_ZLIB ? "{\"id\": \"zlib\"" :
+		compression == cmb::CHUNK_COMPRESSION_ZSTD ? "{\"id\": \"zstd\"" : "null";
+	for (std::size_t level = 0; level < levels.size(); ++level) {
+		array_t expected = cmb::assemble_level(levels[level]);
+		std::ostringstream zarray, shape;
+		zarray << path << "/" << level << "/.zarray";
+		shape << "\"shape\": [" << expected.shape()[0] << ", " << expected.shape()[1] << ", " << expected.shape()[2] << "]";
+		check_contains(zarray.str(), shape.str());
+		check_contains(zarray.str(), "\"chunks\": [5, 3, 4]");
+		check_contains(zarray.str(), "\"dtype\": \"" + cmb::zarr_dtype<label_t>() + "\"");
+		check_contains(zarray.str(), std::string("\"compressor\": ") + compressor_id);
+		BOOST_CHECK(read_level(path, writer, level, expected) == expected);
+	}
+
+	QDir(QString::fromStdString(path)).removeRecursively();
+}
+
+BOOST_AUTO_TEST_CASE(test_chunked_writer_uncompressed)
+{
+	check_round_trip("test_chunked_writer_raw", cmb::CHUNK_COMPRESSION_NONE);
+}
+
+BOOST_AUTO_TEST_CASE(test_chunked_writer_default_compression)
+{
+	check_round_trip("test_chunked_writer_default", cmb::default_chunk_compression());
+}
+
+BOOST_AUTO_TEST_CASE(test_zarr_dtype)
+{
+	BOOST_CHECK_EQUAL(cmb::zarr_dtype<uint8_t>(), "|u1");
+	BOOST_CHECK_EQUAL(cmb::zarr_dtype<bool>(), "|b1");
+	const std::string order = cmb::host_is_little_endian() ? "<" : ">";
+	BOOST_CHECK_EQUAL(cmb::zarr_dtype<uint16_t>(), order + "u2");
+	BOOST_CHECK_EQUAL(cmb::zarr_dtype<int32_t>(), order + "i4");
+	BOOST_CHECK_EQUAL(cmb::zarr_dtype<double>(), order + "f8");
+}
+
+BOOST_AUTO_TEST_CASE(test_chunked_writer_rejects_empty_chunks)
+{
+	typedef boost::multi_array<uint16_t, 2> array_t;
+	typedef cmb::chunked_pyramid_writer_t<array_t> writer_t;
+	writer_t::extents_t original = {{8, 8}};
+	writer_t::extents_t chunks = {{4, 0}};
+	BOOST_CHECK_THROW(writer_t("test_chunked_writer_empty", original, chunks), std::invalid_argument);
+	BOOST_CHECK(! QDir(QString::fromStdString("test_chunked_writer_empty")).exists());
+}
+
+// Writers told the wrong image shape must fail loudly, not overrun or skip chunks
+BOOST_AUTO_TEST_CASE(test_chunked_writer_rejects_shape_mismatch)
+{
+	array_t original(boost::extents[24][8][16]);
+	std::fill(original.data(), original.data() + original.num_elements(), label_t(1));
+	writer_t::extents_t chunk_extents = {{5, 3, 4}};
+
+	// Rows of the wrong width are refused by the worker that rendered them
+	const std::string wide_path = "test_chunked_writer_wide";
+	{
+		writer_t::extents_t wide = {{24, 16, 16}};
+		writer_t writer(wide_path, wide, chunk_extents);
+		BOOST_CHECK_THROW(cmb::parallel_downsample_all(original, fake_topology({2, 1}), writer.slab_callback()),
+			std::invalid_argument);
+	}
+	QDir(QString::fromStdString(wide_path)).removeRecursively();
+
+	// Too few rows leave the last chunks unwritten, which finish() reports
+	const std::string tall_path = "test_chunked_writer_tall";
+	{
+		writer_t::extents_t tall = {{32, 8, 16}};
+		writer_t writer(tall_path, tall, chunk_extents);
+		cmb::parallel_downsample_all(original, fake_topology({2, 1}), writer.slab_callback());
+		BOOST_CHECK_THROW(writer.finish(), std::runtime_error);
+	}
+	QDir(QString::fromStdString(tall_path)).removeRecursively();
+}
+
+BOOST_AUTO_TEST_CASE(test_chunked_writer_rejects_idle_queue)
+{
+	array_t original(boost::extents[8][8][8]);
+	std::fill(original.data(), original.data() + original.num_elements(), label_t(1));
+	writer_t::extents_t chunk_extents = {{4, 4, 4}};
+
+	// Nobody would ever drain the queue
+	BOOST_CHECK_THROW(writer_t("test_chunked_writer_idle", original, chunk_extents, cmb::CHUNK_COMPRESSION_NONE, 0),
+		std::invalid_argument);
+	BOOST_CHECK(! QDir(QString::fromStdString("test_chunked_writer_idle")).exists());
+
+	// Nor is it drained once finish() has returned
+	const std::string path = "test_chunked_writer_closed";
+	{
+		writer_t writer(path, original, chunk_extents, cmb::CHUNK_COMPRESSION_NONE, 1);
+		writer.finish();
+		auto levels = cmb::parallel_downsample_all(original, fake_topology({1}));
+		BOOST_CHECK_THROW(writer.enqueue_slab(0, levels[0][0]), std::logic_error);
+	}
+	QDir(QString::fromStdString(path)).removeRecursively();
+}
+
+// A failed write must reach the caller, even with workers waiting on a full queue
+BOOST_AUTO_TEST_CASE(test_chunked_writer_reports_write_errors)
+{
+	array_t original(boost::extents[64][8][8]);
+	std::fill(original.data(), original.data() + original.num_elements(), label_t(1));
+	writer_t::extents_t chunk_extents = {{2, 4, 4}};
+
+	const std::string path = "test_chunked_writer_blocked";
+	{
+		writer_t writer(path, original, chunk_extents, cmb::CHUNK_COMPRESSION_NONE, 1);
+		std::ofstream(path + "/0"); // a file where level 0's directory belongs
+		BOOST_CHECK_THROW({
+			cmb::parallel_downsample_all(original, fake_topology({4}), writer.slab_callback());
+			writer.finish();
+		}, std::runtime_error);
+	}
+	QDir(QString::fromStdString(path)).removeRecursively();
+}
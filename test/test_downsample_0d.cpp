@@ -58,4 +58,32 @@ BOOST_AUTO_TEST_CASE(test_downsample_zero_d_histograms)
 	BOOST_CHECK_EQUAL(downsampled.get_mode(), 2);
 }
 
+// Do disjoint label partitions add back up to the whole histogram?
+BOOST_AUTO_TEST_CASE(test_downsample_zero_d_partitions)
+{
+	typedef int label_t;
+	typedef cmb::histogram_t<label_t> hist_t;
 
+	hist_t whole;
+	for (label_t label = 0; label < 100; ++label)
+		whole.agglomerate_scalar(label, 1);
+	whole.agglomerate_scalar(42, 5);
+	BOOST_CHECK_EQUAL(whole.get_mode(), 42);
+	BOOST_CHECK_EQUAL(whole.get_mode_count(), 6);
+
+	const std::size_t partition_count = 3;
+	std::vector<hist_t> partitions(partition_count);
+	whole.for_each_label([&](const label_t& label, const hist_t::count_t& count) {
+		partitions[hist_t::partition_of(label, partition_count)].agglomerate_scalar(label, count);
+	});
+	hist_t best;
+	std::size_t label_count = 0;
+	for (const hist_t& partition : partitions) {
+		label_count += partition.label_count();
+		if (partition.get_mode_count() > best.get_mode_count())
+			best = partition;
+	}
+	BOOST_CHECK_EQUAL(label_count, whole.label_count());
+	BOOST_CHECK_EQUAL(best.get_mode(), 42);
+	BOOST_CHECK_EQUAL(best.get_mode_count(), 6);
+}
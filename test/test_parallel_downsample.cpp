@@ -0,0 +1,218 @@
+// (MIT license)
+/*
+Copyright(c) 2017 Christopher M. Bruns
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Stifle MSVC unchecked iterator warning
+#pragma warning( disable : 4996 )
+
+// local headers
+#include "fake_topology.hpp"
+#include "modal_downsample.hpp"
+#include "parallel_downsample.hpp"
+
+// standard headers
+#include <cstdlib>
+#include <vector>
+
+#define BOOST_TEST_MODULE ParallelDownsample
+
+//VERY IMPORTANT - include this last
+#include <boost/test/unit_test.hpp>
+
+typedef int label_t;
+typedef cmb::histogram_t<label_t> hist_t;
+
+// Several NUMA nodes, so the slab partitioning gets exercised,
+// including slabs with odd row counts.
+cmb::numa_topology_t three_node_topology()
+{
+	return fake_topology({1, 2, 1});
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_cpu_list)
+{
+	cmb::cpu_list_t cpus = cmb::parse_cpu_list("0-2,8,10-11\n");
+	const int expected[] = {0, 1, 2, 8, 10, 11};
+	BOOST_CHECK_EQUAL_COLLECTIONS(cpus.begin(), cpus.end(), expected, expected + 6);
+}
+
+// The d = 2, L1 = 2, L2 = 3 example from the spec
+BOOST_AUTO_TEST_CASE(test_parallel_example1)
+{
+	typedef boost::multi_array<label_t, 2> array_t;
+	label_t input_primitive[4][8] = {
+		{ 1,1,1,1,1,1,1,1 },
+		{ 1,2,1,2,1,2,1,2 },
+		{ 1,1,2,2,2,2,2,2 },
+		{ 1,2,2,2,2,2,2,2 }
+	};
+	array_t input(boost::extents[4][8]);
+	memcpy(input.data(), input_primitive, input.num_elements() * sizeof(label_t));
+
+	label_t expected1_primitive[2][4] = {
+		{ 1,1,1,1 },
+		{ 1,2,2,2 },
+	};
+	array_t expected1(boost::extents[2][4]);
+	memcpy(expected1.data(), expected1_primitive, expected1.num_elements() * sizeof(label_t));
+
+	label_t expected2_primitive[1][2] = {
+		{ 1,2 },
+	};
+	array_t expected2(boost::extents[1][2]);
+	memcpy(expected2.data(), expected2_primitive, expected2.num_elements() * sizeof(label_t));
+
+	auto levels = cmb::parallel_downsample_all(input, three_node_topology());
+	BOOST_REQUIRE_EQUAL(levels.size(), 2);
+	BOOST_CHECK(cmb::assemble_level(levels[0]) == expected1);
+	BOOST_CHECK(cmb::assemble_level(levels[1]) == expected2);
+}
+
+// Parallel pyramid must match the serial one, level by level
+BOOST_AUTO_TEST_CASE(test_parallel_matches_serial_3d)
+{
+	typedef boost::multi_array<label_t, 3> array_t;
+	typedef boost::multi_array<hist_t, 3> hist_array_t;
+
+	array_t original(boost::extents[24][8][16]);
+	std::srand(42);
+	for (label_t* p = original.data(); p != original.data() + original.num_elements(); ++p)
+		*p = std::rand() % 5;
+
+	auto levels = cmb::parallel_downsample_all(original, three_node_topology());
+	BOOST_REQUIRE_EQUAL(levels.size(), 3);
+
+	hist_array_t hist1(boost::extents[12][4][8]);
+	cmb::downsample_array(hist1, original);
+	array_t expected1(boost::extents[12][4][8]);
+	cmb::render_array(expected1, hist1);
+	BOOST_CHECK(cmb::assemble_level(levels[0]) == expected1);
+
+	hist_array_t hist2(boost::extents[6][2][4]);
+	cmb::downsample_array(hist2, hist1);
+	array_t expected2(boost::extents[6][2][4]);
+	cmb::render_array(expected2, hist2);
+	BOOST_CHECK(cmb::assemble_level(levels[1]) == expected2);
+
+	hist_array_t hist3(boost::extents[3][1][2]);
+	cmb::downsample_array(hist3, hist2);
+	array_t expected3(boost::extents[3][1][2]);
+	cmb::render_array(expected3, hist3);
+	BOOST_CHECK(cmb::assemble_level(levels[2]) == expected3);
+}
+
+// Many distinct labels per histogram, so the top levels, with fewer rows
+// than workers, go through the partitioned reduction
+BOOST_AUTO_TEST_CASE(test_parallel_high_cardinality_2d)
+{
+	typedef boost::multi_array<label_t, 2> array_t;
+	typedef boost::multi_array<hist_t, 2> hist_array_t;
+
+	// Every third pixel is label 7, the rest are all distinct
+	array_t original(boost::extents[64][64]);
+	for (int i = 0; i < 64 * 64; ++i)
+		original.data()[i] = (i % 3 == 0) ? 7 : 100 + i;
+
+	auto levels = cmb::parallel_downsample_all(original, three_node_topology());
+	BOOST_REQUIRE_EQUAL(levels.size(), 6);
+
+	hist_array_t hist(boost::extents[64][64]);
+	for (int i = 0; i < 64 * 64; ++i)
+		hist.data()[i].agglomerate_scalar(original.data()[i]);
+	for (std::size_t level = 0; level < levels.size(); ++level) {
+		const std::size_t dim = 32 >> level;
+		hist_array_t downsampled(boost::extents[dim][dim]);
+		cmb::downsample_array(downsampled, hist);
+		array_t expected(boost::extents[dim][dim]);
+		cmb::render_array(expected, downsampled);
+		BOOST_CHECK(cmb::assemble_level(levels[level]) == expected);
+		hist.resize(boost::extents[dim][dim]);
+		hist = downsampled;
+	}
+	BOOST_CHECK_EQUAL(cmb::assemble_level(levels.back())[0][0], 7);
+}
+
+// Serial pyramid of a 2-D array, for comparison
+std::vector<boost::multi_array<label_t, 2> > serial_pyramid_2d(const boost::multi_array<label_t, 2>& original)
+{
+	typedef boost::multi_array<label_t, 2> array_t;
+	typedef boost::multi_array<hist_t, 2> hist_array_t;
+
+	std::vector<array_t> result;
+	std::size_t dim = original.shape()[0];
+	hist_array_t hist(boost::extents[dim][dim]);
+	for (std::size_t i = 0; i < original.num_elements(); ++i)
+		hist.data()[i].agglomerate_scalar(original.data()[i]);
+	for (dim /= 2; dim >= 1; dim /= 2) {
+		hist_array_t downsampled(boost::extents[dim][dim]);
+		cmb::downsample_array(downsampled, hist);
+		result.push_back(array_t(boost::extents[dim][dim]));
+		cmb::render_array(result.back(), downsampled);
+		hist.resize(boost::extents[dim][dim]);
+		hist = downsampled;
+	}
+	return result;
+}
+
+// Lots of tied counts: the result must not depend on the number of
+// workers, in either the slab or the partitioned path
+BOOST_AUTO_TEST_CASE(test_parallel_ties_match_serial)
+{
+	typedef boost::multi_array<label_t, 2> array_t;
+
+	const int label_ranges[] = {2, 300};
+	const std::size_t worker_counts[] = {1, 3, 4, 7, 16};
+	for (int label_range : label_ranges) {
+		array_t original(boost::extents[64][64]);
+		std::srand(label_range);
+		for (label_t* p = original.data(); p != original.data() + original.num_elements(); ++p)
+			*p = std::rand() % label_range;
+		const std::vector<array_t> expected = serial_pyramid_2d(original);
+
+		for (std::size_t workers : worker_counts) {
+			auto levels = cmb::parallel_downsample_all(original, fake_topology({workers}));
+			BOOST_REQUIRE_EQUAL(levels.size(), expected.size());
+			for (std::size_t level = 0; level < levels.size(); ++level) {
+				BOOST_CHECK_MESSAGE(cmb::assemble_level(levels[level]) == expected[level],
+					"labels " << label_range << ", workers " << workers << ", level " << level);
+			}
+		}
+	}
+}
+
+// One dimension, on whatever NUMA layout this machine really has
+BOOST_AUTO_TEST_CASE(test_parallel_detected_topology_1d)
+{
+	typedef boost::multi_array<label_t, 1> array_t;
+	array_t original(boost::extents[64]);
+	const label_t test_value = 50;
+	std::fill(original.begin(), original.end(), test_value);
+
+	auto levels = cmb::parallel_downsample_all(original);
+	BOOST_REQUIRE_EQUAL(levels.size(), 6);
+	for (const auto& level : levels) {
+		array_t assembled = cmb::assemble_level(level);
+		for (label_t label : assembled)
+			BOOST_CHECK_EQUAL(label, test_value);
+	}
+	BOOST_CHECK_EQUAL(cmb::assemble_level(levels.back()).size(), 1);
+}